@@ -1,9 +1,12 @@
-#include <c10/util/irange.h>
+#include <c10/util/SmallVector.h>
+#include <c10/util/hash.h>
 #include <torch/csrc/jit/jit_log.h>
 #include <torch/csrc/jit/passes/dead_code_elimination.h>
 #include <torch/csrc/jit/passes/onnx/helper.h>
 #include <torch/csrc/jit/passes/onnx/scalar_type_analysis.h>
 
+#include <array>
+
 namespace torch {
 namespace jit {
 
@@ -14,98 +17,124 @@ using namespace ::c10::onnx;
 namespace {
 const int ONNX_OPSET_14 = 14;
 
-static const std::unordered_map<c10::ScalarType, int, ScalarTypeHashFunction>
-    scalarTypeToONNXTypeMap = {
-        {c10::kFloat, 1},
-        {c10::kByte, 2},
-        {c10::kChar, 3},
-        {c10::kShort, 5},
-        {c10::kInt, 6},
-        {c10::kLong, 7},
-        {c10::kBool, 9},
-        {c10::kHalf, 10},
-        {c10::kDouble, 11},
-        {c10::kQInt8, 12},
-        {c10::kQUInt8, 13},
-        {c10::kQInt32, 14},
-        {c10::kBFloat16, 15},
-};
+// Flat table mapping c10::ScalarType to the corresponding ONNX type,
+// indexed directly by the scalar type value. Entries without an ONNX
+// counterpart are -1.
+static constexpr std::array<
+    int8_t,
+    static_cast<size_t>(c10::ScalarType::NumOptions)>
+    scalarTypeToONNXTypeTable = []() {
+      std::array<int8_t, static_cast<size_t>(c10::ScalarType::NumOptions)> a{};
+      for (auto& e : a) {
+        e = -1;
+      }
+      a[static_cast<size_t>(c10::kFloat)] = 1;
+      a[static_cast<size_t>(c10::kByte)] = 2;
+      a[static_cast<size_t>(c10::kChar)] = 3;
+      a[static_cast<size_t>(c10::kShort)] = 5;
+      a[static_cast<size_t>(c10::kInt)] = 6;
+      a[static_cast<size_t>(c10::kLong)] = 7;
+      a[static_cast<size_t>(c10::kBool)] = 9;
+      a[static_cast<size_t>(c10::kHalf)] = 10;
+      a[static_cast<size_t>(c10::kDouble)] = 11;
+      a[static_cast<size_t>(c10::kQInt8)] = 12;
+      a[static_cast<size_t>(c10::kQUInt8)] = 13;
+      a[static_cast<size_t>(c10::kQInt32)] = 14;
+      a[static_cast<size_t>(c10::kBFloat16)] = 15;
+      return a;
+    }();
 
 static int64_t ScalarTypeToONNXType(const c10::ScalarType& st) {
-  int64_t onnx_type = -1;
-  const auto it = scalarTypeToONNXTypeMap.find(st);
-  if (it != scalarTypeToONNXTypeMap.end()) {
-    onnx_type = it->second;
-  }
-  return onnx_type;
+  const auto idx = static_cast<size_t>(st);
+  return idx < scalarTypeToONNXTypeTable.size() ? scalarTypeToONNXTypeTable[idx]
+                                                : -1;
 }
 
 // For these operators, all inputs and outputs share the same scalar type.
 // There is no operator-wise special case handling needed.
-static const std::unordered_set<NodeKind> standardOps = {
-    onnx::Add,
-    onnx::Concat,
-    onnx::Div,
-    onnx::Gemm,
-    onnx::Min,
-    onnx::Max,
-    onnx::Mod,
-    onnx::Mul,
-    onnx::Pow,
-    onnx::Sub,
-    onnx::MatMul,
-};
-
-// For these operators, all inputs share the same scalar type.
-// The output scalar type is always Bool.
-static const std::unordered_set<NodeKind> comparisonOps = {
-    onnx::Greater,
-    onnx::Less,
-    onnx::Equal,
-    onnx::GreaterOrEqual,
-    onnx::LessOrEqual,
-};
-
 static bool IsStandardOp(const NodeKind& nkind) {
-  return standardOps.find(nkind) != standardOps.end();
+  switch (nkind) {
+    case onnx::Add:
+    case onnx::Concat:
+    case onnx::Div:
+    case onnx::Gemm:
+    case onnx::Min:
+    case onnx::Max:
+    case onnx::Mod:
+    case onnx::Mul:
+    case onnx::Pow:
+    case onnx::Sub:
+    case onnx::MatMul:
+      return true;
+    default:
+      return false;
+  }
 }
 
+// For these operators, all inputs share the same scalar type.
+// The output scalar type is always Bool.
 static bool IsComparisonOp(const NodeKind& nkind) {
-  return comparisonOps.find(nkind) != comparisonOps.end();
+  switch (nkind) {
+    case onnx::Greater:
+    case onnx::Less:
+    case onnx::Equal:
+    case onnx::GreaterOrEqual:
+    case onnx::LessOrEqual:
+      return true;
+    default:
+      return false;
+  }
 }
 
+// Cache of Cast nodes (and retyped Constants) already inserted for a given
+// (source value, ONNX target type) pair, so sibling nodes that need the same
+// conversion share one node instead of each inserting a duplicate. The cache
+// is scoped to a single block traversal, which guarantees that a cached value
+// dominates every later use within that block.
+using CastValueCache = std::unordered_map<
+    std::pair<Value*, int64_t>,
+    Value*,
+    c10::hash<std::pair<Value*, int64_t>>>;
+
 static TensorTypePtr CreateProfiledTensorTypeWithScalarType(
-    const TensorTypePtr& typePtr,
+    TensorType* typePtr,
     const c10::ScalarType& scalar_type) {
   TORCH_INTERNAL_ASSERT(typePtr != nullptr);
   return typePtr->withScalarType({scalar_type});
 }
 
+// Single switch over the union of standard and comparison ops, so that
+// classifying a node does not dispatch through both predicates above.
 static bool IsImplicitCastSupported(const NodeKind& nodeKind) {
-  return IsStandardOp(nodeKind) || IsComparisonOp(nodeKind);
-}
-
-static c10::optional<c10::ScalarType> PromoteScalarTypes(
-    const std::vector<c10::ScalarType>& types) {
-  if (types.empty()) {
-    return c10::nullopt;
-  }
-  auto st = types[0];
-  for (const auto i : c10::irange(1, types.size())) {
-    st = c10::promoteTypes(st, types[i]);
+  switch (nodeKind) {
+    case onnx::Add:
+    case onnx::Concat:
+    case onnx::Div:
+    case onnx::Gemm:
+    case onnx::Min:
+    case onnx::Max:
+    case onnx::Mod:
+    case onnx::Mul:
+    case onnx::Pow:
+    case onnx::Sub:
+    case onnx::MatMul:
+    case onnx::Greater:
+    case onnx::Less:
+    case onnx::Equal:
+    case onnx::GreaterOrEqual:
+    case onnx::LessOrEqual:
+      return true;
+    default:
+      return false;
   }
-  return st;
 }
 
 // Type promotion between scalars and tensors
 // per logic here
 // https://pytorch.org/docs/master/tensor_attributes.html#tensor-attributes
 static c10::optional<c10::ScalarType> PromoteScalarTypesWithCategory(
-    const std::vector<c10::ScalarType>& typesFromTensors,
-    const std::vector<c10::ScalarType>& typesFromScalars) {
-  auto typeFromTensor = PromoteScalarTypes(typesFromTensors);
-  auto typeFromScalar = PromoteScalarTypes(typesFromScalars);
-
+    const c10::optional<c10::ScalarType>& typeFromTensor,
+    const c10::optional<c10::ScalarType>& typeFromScalar) {
   auto getTypeCategory = [](c10::ScalarType t) {
     if (c10::kBool == t) {
       return 1;
@@ -134,9 +163,58 @@ static c10::optional<c10::ScalarType> PromoteScalarTypesWithCategory(
   return typeFromTensor;
 }
 
-static c10::optional<c10::ScalarType> InferExpectedScalarType(const Node* n) {
-  std::vector<c10::ScalarType> typesFromTensors;
-  std::vector<c10::ScalarType> typesFromScalars;
+// Returns the expected scalar type plus whether the node is already
+// consistent with it, i.e. no input needs a cast or constant rewrite.
+static std::pair<c10::optional<c10::ScalarType>, bool> InferExpectedScalarType(
+    const Node* n) {
+  // Fast path: when every input is a plain tensor with the same known scalar
+  // type, the promotion rules below cannot produce anything else, so the
+  // categorized scan is skipped. Constant, Gather and graph-input producers
+  // carry scalar/tensor distinctions and need the full analysis.
+  bool need_full_scan = false;
+  c10::optional<c10::ScalarType> common_type;
+  for (const Value* input : n->inputs()) {
+    const auto in_kind = input->node()->kind();
+    if (in_kind == onnx::Constant || in_kind == onnx::Gather ||
+        in_kind == prim::Param) {
+      need_full_scan = true;
+      break;
+    }
+    auto* tensor_type = input->type()->castRaw<TensorType>();
+    auto input_type = tensor_type ? tensor_type->scalarType() : c10::nullopt;
+    if (!input_type) {
+      need_full_scan = true;
+      break;
+    }
+    if (!common_type) {
+      common_type = input_type;
+    } else if (*common_type != *input_type) {
+      need_full_scan = true;
+      break;
+    }
+  }
+  if (!need_full_scan) {
+    if (IsComparisonOp(n->kind())) {
+      return {common_type, true};
+    }
+    if (auto* output_type = n->output()->type()->castRaw<TensorType>()) {
+      if (auto output_st = output_type->scalarType()) {
+        // Inputs only stay untouched when the output type agrees with them.
+        return {output_st, output_st == common_type};
+      }
+    }
+    return {common_type, true};
+  }
+
+  // Running reductions over the input scalar types, fused into the input
+  // scan below so no intermediate list of types is materialized.
+  c10::optional<c10::ScalarType> typeFromTensors;
+  c10::optional<c10::ScalarType> typeFromScalars;
+
+  auto promote_into = [](c10::optional<c10::ScalarType>& acc,
+                         c10::ScalarType scalar_type) {
+    acc = acc ? c10::promoteTypes(*acc, scalar_type) : scalar_type;
+  };
 
   auto get_scalar_type =
       [](const Value* input) -> c10::optional<at::ScalarType> {
@@ -145,79 +223,80 @@ static c10::optional<c10::ScalarType> InferExpectedScalarType(const Node* n) {
     }
     return c10::nullopt;
   };
-  auto emplace_type_from_scalar =
-      [&typesFromTensors, &typesFromScalars](at::ScalarType scalar_type) {
-        // Mimic PyTorch scalar type promotion logic
-        // from https://github.com/pytorch/pytorch/issues/9515
-        // Quoting:
-        //    A Tensor is a considered a "wrapped number" if it is
-        //    auto-wrapped from a C++ or Python number type. Integer types are
-        //    wrapped as 0-dim int64 tensors and floating-point types are
-        //    wrapped as 0-dim double tensors.
-        auto default_scalar_type =
-            at::typeMetaToScalarType(at::get_default_dtype());
-        switch (scalar_type) {
-          case at::kDouble:
-            // floating-point numbers wrapped as double tensors are
-            // considered to have default type, instead of double.
-            typesFromScalars.emplace_back(default_scalar_type);
-            break;
-          case at::kLong:
-          case at::kBool:
-            // bool and integer numbers remain the same type.
-            typesFromScalars.emplace_back(scalar_type);
-            break;
-          default:
-            // other types are not from wrapped numbers,
-            // track them as types from tensors.
-            typesFromTensors.emplace_back(scalar_type);
-            break;
-        }
-      };
-
-  std::for_each(
-      n->inputs().begin(), n->inputs().end(), [&](const Value* input) {
-        auto nkind = input->node()->kind();
-        if (nkind == onnx::Gather &&
-            input->node()->input(0)->node()->kind() == onnx::Shape) {
-          // This is a special pattern generated by code like `dim_size =
-          // x.size(0)`. It gets converted to the below ONNX IR graph
-          //    %1 : Long() = onnx::Constant[value={0}]()
-          //    %2 : Tensor = onnx::Shape(%x)
-          //    %dim_size : Long() = onnx::Gather(%2, %1)
-          // `dim_size` is treated in PyTorch as Scalar.
-          // However, in the ONNX IR graph, it is an output of onnx::Gather,
-          // which is by default considered as a tensor.
-          typesFromScalars.emplace_back(c10::kLong);
-        } else if (nkind == onnx::Constant) {
-          auto tensor = input->node()->t(attr::value);
-          auto rank = tensor.dim();
-          auto scalar_type = tensor.scalar_type();
-
-          if (rank == 0) {
-            emplace_type_from_scalar(scalar_type);
-          } else {
-            typesFromTensors.emplace_back(scalar_type);
-          }
-        } else if (nkind == prim::Param) {
-          // ONNX doesn't support scalar as graph input. When
-          // seeing a scalar input, we convert its expected type to tensor.
-          if (auto scalar_type = get_scalar_type(input)) {
-            auto tensor_type = input->type()->castRaw<TensorType>();
-            // get_scalar_type returns non-null value already guarantees
-            // that the input has a valid tensor_type.
-            TORCH_INTERNAL_ASSERT(nullptr != tensor_type);
-            auto rank = tensor_type->dim();
-            if (rank && rank.value() == 0) {
-              emplace_type_from_scalar(scalar_type.value());
-            } else {
-              typesFromTensors.emplace_back(scalar_type.value());
-            }
-          }
-        } else if (auto scalar_type = get_scalar_type(input)) {
-          typesFromTensors.emplace_back(*scalar_type);
+  auto emplace_type_from_scalar = [&](at::ScalarType scalar_type) {
+    // Mimic PyTorch scalar type promotion logic
+    // from https://github.com/pytorch/pytorch/issues/9515
+    // Quoting:
+    //    A Tensor is a considered a "wrapped number" if it is
+    //    auto-wrapped from a C++ or Python number type. Integer types are
+    //    wrapped as 0-dim int64 tensors and floating-point types are
+    //    wrapped as 0-dim double tensors.
+    auto default_scalar_type =
+        at::typeMetaToScalarType(at::get_default_dtype());
+    switch (scalar_type) {
+      case at::kDouble:
+        // floating-point numbers wrapped as double tensors are
+        // considered to have default type, instead of double.
+        promote_into(typeFromScalars, default_scalar_type);
+        break;
+      case at::kLong:
+      case at::kBool:
+        // bool and integer numbers remain the same type.
+        promote_into(typeFromScalars, scalar_type);
+        break;
+      default:
+        // other types are not from wrapped numbers,
+        // track them as types from tensors.
+        promote_into(typeFromTensors, scalar_type);
+        break;
+    }
+  };
+
+  for (const Value* input : n->inputs()) {
+    // Hoist the producing node and its kind once per input; the branches
+    // below would otherwise reload them through the same pointer chain.
+    const Node* in_node = input->node();
+    const auto in_kind = in_node->kind();
+    if (in_kind == onnx::Gather &&
+        in_node->input(0)->node()->kind() == onnx::Shape) {
+      // This is a special pattern generated by code like `dim_size =
+      // x.size(0)`. It gets converted to the below ONNX IR graph
+      //    %1 : Long() = onnx::Constant[value={0}]()
+      //    %2 : Tensor = onnx::Shape(%x)
+      //    %dim_size : Long() = onnx::Gather(%2, %1)
+      // `dim_size` is treated in PyTorch as Scalar.
+      // However, in the ONNX IR graph, it is an output of onnx::Gather,
+      // which is by default considered as a tensor.
+      promote_into(typeFromScalars, c10::kLong);
+    } else if (in_kind == onnx::Constant) {
+      auto tensor = in_node->t(attr::value);
+      auto rank = tensor.dim();
+      auto scalar_type = tensor.scalar_type();
+
+      if (rank == 0) {
+        emplace_type_from_scalar(scalar_type);
+      } else {
+        promote_into(typeFromTensors, scalar_type);
+      }
+    } else if (in_kind == prim::Param) {
+      // ONNX doesn't support scalar as graph input. When
+      // seeing a scalar input, we convert its expected type to tensor.
+      if (auto scalar_type = get_scalar_type(input)) {
+        auto tensor_type = input->type()->castRaw<TensorType>();
+        // get_scalar_type returns non-null value already guarantees
+        // that the input has a valid tensor_type.
+        TORCH_INTERNAL_ASSERT(nullptr != tensor_type);
+        auto rank = tensor_type->dim();
+        if (rank && rank.value() == 0) {
+          emplace_type_from_scalar(scalar_type.value());
+        } else {
+          promote_into(typeFromTensors, scalar_type.value());
         }
-      });
+      }
+    } else if (auto scalar_type = get_scalar_type(input)) {
+      promote_into(typeFromTensors, *scalar_type);
+    }
+  }
 
   c10::optional<c10::ScalarType> st = c10::nullopt;
   const auto output_st = get_scalar_type(n->output());
@@ -225,11 +304,10 @@ static c10::optional<c10::ScalarType> InferExpectedScalarType(const Node* n) {
   if (IsComparisonOp(n->kind())) {
     // For comparison ops, always promote scalar type to highest among inputs,
     // regardless if that input is a tensor or scalar.
-    typesFromScalars.insert(
-        typesFromScalars.end(),
-        typesFromTensors.begin(),
-        typesFromTensors.end());
-    st = PromoteScalarTypes(typesFromScalars);
+    st = typeFromScalars;
+    if (typeFromTensors) {
+      st = st ? c10::promoteTypes(*st, *typeFromTensors) : typeFromTensors;
+    }
   } else {
     if (output_st) {
       // If output scalar type is available, use that.
@@ -240,11 +318,11 @@ static c10::optional<c10::ScalarType> InferExpectedScalarType(const Node* n) {
       // casting).
       // Per logic here
       // https://pytorch.org/docs/master/tensor_attributes.html#tensor-attributes
-      st = PromoteScalarTypesWithCategory(typesFromTensors, typesFromScalars);
+      st = PromoteScalarTypesWithCategory(typeFromTensors, typeFromScalars);
     }
   }
 
-  return st;
+  return {st, false};
 }
 
 static c10::optional<c10::ScalarType> LowPrecisionCastForStandardOps(
@@ -264,10 +342,13 @@ static c10::optional<c10::ScalarType> LowPrecisionCastForStandardOps(
 
 static void UpdateScalarTypeForInputs(
     Node* n,
-    const c10::ScalarType& scalar_type) {
+    const c10::ScalarType& scalar_type,
+    CastValueCache* cast_cache = nullptr) {
   const int64_t onnx_type = ScalarTypeToONNXType(scalar_type);
   if (onnx_type < 0) {
-    TORCH_WARN(
+    // Graphs hitting this typically do so for every node carrying the
+    // unsupported type; warn once instead of flooding the log.
+    TORCH_WARN_ONCE(
         "ONNX Scalar Type Analysis - Scalar type: ",
         c10::toString(scalar_type),
         " of input tensor in operator: ",
@@ -276,27 +357,41 @@ static void UpdateScalarTypeForInputs(
     return;
   }
 
+  Graph* graph = n->owningGraph();
   for (auto input : n->inputs()) {
-    auto input_tensor_type = input->type()->cast<TensorType>();
+    auto* input_tensor_type = input->type()->castRaw<TensorType>();
     auto input_scalar_type =
         input_tensor_type ? input_tensor_type->scalarType() : c10::nullopt;
 
-    if ((input->node()->kind() == onnx::Constant) ||
+    Node* in_node = input->node();
+    const bool is_const = in_node->kind() == onnx::Constant;
+    if (is_const ||
         (input_scalar_type && (*input_scalar_type != scalar_type))) {
-      if (input->node()->kind() == onnx::Constant) {
+      const auto cache_key = std::make_pair(input, onnx_type);
+      if (cast_cache) {
+        auto it = cast_cache->find(cache_key);
+        if (it != cast_cache->end()) {
+          n->replaceInputWith(input, it->second);
+          continue;
+        }
+      }
+      if (is_const) {
         // Fix up the scalar directly instead of inserting a cast operator.
         // TODO: Keep only the else branch once constant_folding is enabled by
         // default.
-        at::Tensor val = input->node()->t(attr::value);
+        at::Tensor val = in_node->t(attr::value);
         at::Tensor new_val = val.to(scalar_type);
-        Node* const_node = n->owningGraph()->create(onnx::Constant);
+        Node* const_node = graph->create(onnx::Constant);
         const_node->t_(attr::value, new_val);
         const_node->insertBefore(n);
         const_node->output()->setType(TensorType::create(new_val));
         const_node->copyMetadata(n);
         n->replaceInputWith(input, const_node->output());
+        if (cast_cache) {
+          (*cast_cache)[cache_key] = const_node->output();
+        }
       } else {
-        Node* cast_node = n->owningGraph()->create(onnx::Cast);
+        Node* cast_node = graph->create(onnx::Cast);
         cast_node->addInput(input);
         cast_node->i_(attr::to, onnx_type);
         cast_node->insertBefore(n);
@@ -304,6 +399,9 @@ static void UpdateScalarTypeForInputs(
             input_tensor_type, scalar_type));
         cast_node->copyMetadata(n);
         n->replaceInputWith(input, cast_node->output());
+        if (cast_cache) {
+          (*cast_cache)[cache_key] = cast_node->output();
+        }
       }
     }
   }
@@ -312,7 +410,7 @@ static void UpdateScalarTypeForInputs(
 static void UpdateScalarTypeForOutput(
     Node* n,
     const c10::ScalarType& scalar_type) {
-  if (auto output_tensor_type = n->output()->type()->cast<TensorType>()) {
+  if (auto* output_tensor_type = n->output()->type()->castRaw<TensorType>()) {
     n->output()->setType(CreateProfiledTensorTypeWithScalarType(
         output_tensor_type, scalar_type));
   }
@@ -349,22 +447,22 @@ static void RecoverScalarTypeForOutput(
 // https://github.com/huggingface/transformers/blob/b020a736c374460af1b34267283f957988350630/src/transformers/models/transfo_xl/modeling_transfo_xl.py#L936
 static void LowPrecisionCastNodeForStandardOps(Node* n, int opset_version) {
   TORCH_INTERNAL_ASSERT(n->outputs().size() == 1);
-  if (n->output()->type()->cast<TensorType>() == nullptr ||
-      n->output()->type()->cast<TensorType>()->scalarType() == c10::nullopt) {
+  const auto* output_tensor_type = n->output()->type()->castRaw<TensorType>();
+  if (output_tensor_type == nullptr ||
+      output_tensor_type->scalarType() == c10::nullopt) {
     // skip LowPrecisionCast if op output type is null.
     return;
   }
-  auto output_scalar_type =
-      n->output()->type()->cast<TensorType>()->scalarType().value();
+  auto output_scalar_type = output_tensor_type->scalarType().value();
   for (size_t i = 0; i < n->inputs().size(); ++i) {
-    if (n->input(i)->type()->cast<TensorType>() == nullptr ||
-        n->input(i)->type()->cast<TensorType>()->scalarType() == c10::nullopt) {
+    const auto* input_tensor_type = n->input(i)->type()->castRaw<TensorType>();
+    if (input_tensor_type == nullptr ||
+        input_tensor_type->scalarType() == c10::nullopt) {
       // skip LowPrecisionCast if any op input type node is null.
       return;
     }
-    auto input_tensor_type =
-        n->input(i)->type()->cast<TensorType>()->scalarType().value();
-    TORCH_INTERNAL_ASSERT(output_scalar_type == input_tensor_type);
+    TORCH_INTERNAL_ASSERT(
+        output_scalar_type == input_tensor_type->scalarType().value());
   }
 
   // The LowPrecision problem will be fixed in ONNX opset 14.
@@ -379,11 +477,16 @@ static void LowPrecisionCastNodeForStandardOps(Node* n, int opset_version) {
   }
 }
 
-static void ImplicitCastNodeForONNX(Node* n) {
+static void ImplicitCastNodeForONNX(
+    Node* n,
+    CastValueCache* cast_cache = nullptr) {
   if (IsImplicitCastSupported(n->kind())) {
-    auto expected_scalar_type = InferExpectedScalarType(n);
+    auto [expected_scalar_type, already_consistent] =
+        InferExpectedScalarType(n);
     if (expected_scalar_type) {
-      UpdateScalarTypeForInputs(n, *expected_scalar_type);
+      if (!already_consistent) {
+        UpdateScalarTypeForInputs(n, *expected_scalar_type, cast_cache);
+      }
       if (!IsComparisonOp(n->kind())) {
         UpdateScalarTypeForOutput(n, *expected_scalar_type);
       }
@@ -391,14 +494,31 @@ static void ImplicitCastNodeForONNX(Node* n) {
   }
 }
 
-static void ImplicitCastForONNX(Block* block) {
-  for (auto it = block->nodes().begin(); it != block->nodes().end(); ++it) {
-    for (auto sub : it->blocks()) {
-      ImplicitCastForONNX(sub);
-    }
+static void RewriteImplicitCasts(Block* block) {
+  // Deeply nested If/Loop blocks in exported models can exhaust the C stack
+  // when traversed recursively, so walk the blocks with an explicit
+  // worklist. Visitation order across blocks does not matter: every cast
+  // insertion only involves values within the node's own block.
+  c10::SmallVector<Block*, 32> worklist;
+  worklist.push_back(block);
+  while (!worklist.empty()) {
+    Block* b = worklist.pop_back_val();
+    CastValueCache cast_cache;
+    for (auto it = b->nodes().begin(); it != b->nodes().end(); ++it) {
+      for (auto sub : it->blocks()) {
+        worklist.push_back(sub);
+      }
 
-    ImplicitCastNodeForONNX(*it);
+      ImplicitCastNodeForONNX(*it, &cast_cache);
+    }
   }
+}
+
+static void ImplicitCastForONNX(Block* block) {
+  RewriteImplicitCasts(block);
+  // Dead code elimination transitively visits sub-blocks, so one pass over
+  // the outer block replaces the per-block runs the rewrite recursion used
+  // to trigger.
   EliminateDeadCode(
       block, true, DCESideEffectPolicy::ALLOW_DELETING_NODES_WITH_SIDE_EFFECTS);
 }